@@ -10,6 +10,7 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
+#include <linux/devm-helpers.h>
 #include <linux/gpio/consumer.h>
 #include <linux/delay.h>
 #include <linux/pm.h>
@@ -17,6 +18,13 @@
 #include <linux/regulator/consumer.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
+#include <linux/completion.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
@@ -29,6 +37,27 @@
 
 #define ES9038Q2M_CHIP_ID_NBR  (0x70)
 
+static bool coalesce_controls;
+module_param(coalesce_controls, bool, 0444);
+MODULE_PARM_DESC(coalesce_controls, "Defer mixer control writes and flush them in merged bursts");
+
+static unsigned int coalesce_delay_ms = 20;
+module_param(coalesce_delay_ms, uint, 0644);
+MODULE_PARM_DESC(coalesce_delay_ms, "Quiet time before deferred control writes are flushed (ms)");
+
+/* Upper bound on how long a deferred control write can wait */
+#define ES9038Q2M_COALESCE_MAX_LATENCY_MS  (100)
+/* Failed flushes are retried with a backoff, then the writes are dropped */
+#define ES9038Q2M_FLUSH_MAX_RETRIES        (5)
+
+static unsigned int dpll_lock_timeout_ms = 500;
+module_param(dpll_lock_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(dpll_lock_timeout_ms, "Maximum wait for DPLL lock in prepare, 0 disables the wait (ms)");
+
+static bool dpll_lock_delay;
+module_param(dpll_lock_delay, bool, 0644);
+MODULE_PARM_DESC(dpll_lock_delay, "Report DPLL lock time the stream did not wait out as startup delay");
+
 #define ES9038Q2M_NUM_SUPPLIES  (3)
 static const char * const es9038q2m_supply_names[ES9038Q2M_NUM_SUPPLIES] = {
 	"DVCC", // Digital Power Supply
@@ -36,8 +65,31 @@ static const char * const es9038q2m_supply_names[ES9038Q2M_NUM_SUPPLIES] = {
 	"AVCC", // Analog Power Supply for DAC
 };
 
+/* Settling time after the supplies come up, at probe and after a brownout */
+#define ES9038Q2M_RESYNC_DELAY_MS      (50)
+/* Retry backoff while the chip does not answer after a supply loss */
+#define ES9038Q2M_RESYNC_MAX_DELAY_MS  (2000)
+#define ES9038Q2M_RESYNC_MAX_RETRIES   (10)
+
+/* Read-only block served by the status_snapshot sysfs file */
+#define ES9038Q2M_STATUS_COUNT        (ES9038Q2M_NUM_REGISTERS - ES9038Q2M_REG_CHIP_ID)
+#define ES9038Q2M_STATUS_MAX_AGE_MS   (1000)
+
+/* Backoff bounds when polling for DPLL lock, also caps each IRQ wait */
+#define ES9038Q2M_LOCK_POLL_MIN_US    (500)
+#define ES9038Q2M_LOCK_POLL_MAX_US    (20000)
+/* How long a stream that started unlocked keeps being timed */
+#define ES9038Q2M_LOCK_LATE_MAX_MS    (5000)
+
+/* Layout of the status_snapshot sysfs file */
+struct es9038q2m_status {
+	__le64 timestamp_ns;                 // CLOCK_MONOTONIC time of the read
+	u8 regs[ES9038Q2M_STATUS_COUNT];     // Registers 0x40 to 0x66
+} __packed;
+
 struct es9038q2m_priv {
 	struct i2c_client *i2c;
+	struct snd_soc_component *component;
     struct regmap *regmap;
     struct regulator_bulk_data supplies[ES9038Q2M_NUM_SUPPLIES];
     struct notifier_block supply_nb[ES9038Q2M_NUM_SUPPLIES];
@@ -49,6 +101,31 @@ struct es9038q2m_priv {
 	int is_master;
     struct mutex lock;
     unsigned int bclk_ratio;
+	bool supply_lost;
+	unsigned int resync_retries;
+	struct delayed_work resync_work;
+	struct mutex status_lock;
+	struct es9038q2m_status status;
+	u64 status_time_ns;
+	bool status_valid;
+	unsigned int status_max_age_ms;
+	bool coalesce;
+	DECLARE_BITMAP(dirty_regs, ES9038Q2M_NUM_REGISTERS);
+	u8 pending_val[ES9038Q2M_NUM_REGISTERS];
+	u8 pending_mask[ES9038Q2M_NUM_REGISTERS];
+	unsigned long flush_deadline;
+	unsigned int flush_retries;
+	struct delayed_work flush_work;
+	bool lock_irq;
+	struct completion dpll_lock;
+	ktime_t dpll_ref_ts;
+	ktime_t dpll_irq_ts;
+	ktime_t dpll_poll_ts;
+	ktime_t dpll_unlocked_ts;
+	ktime_t dpll_late_lock_ts;
+	bool dpll_lock_measured;
+	unsigned int dpll_lock_time_us;
+	struct delayed_work dpll_work;
 };
 
 static const struct reg_default es9038q2m_reg_defaults[] = {
@@ -127,13 +204,350 @@ static const struct soc_enum es9038q2m_filter_enum = SOC_VALUE_ENUM_SINGLE(ES903
 	es9038q2m_filter_texts, 
 	es9038q2m_filter_values);
 
+/*
+ * Register value once the pending control writes are flushed. Must be called
+ * with the lock held.
+ */
+static unsigned int es9038q2m_pending_read(struct es9038q2m_priv *es9038, unsigned int reg)
+{
+	unsigned int val = 0;
+
+	/* Control registers are cached, this never touches the bus */
+	regmap_read(es9038->regmap, reg, &val);
+
+	return (val & ~es9038->pending_mask[reg]) | es9038->pending_val[reg];
+}
+
+/*
+ * Queues a field update for the flush work and returns 1 if the value
+ * changes. Must be called with the lock held.
+ */
+static int es9038q2m_pending_update(struct es9038q2m_priv *es9038, unsigned int reg,
+				    unsigned int mask, unsigned int val)
+{
+	unsigned int old = es9038q2m_pending_read(es9038, reg);
+
+	if (((old & ~mask) | (val & mask)) == old)
+		return 0;
+
+	es9038->pending_mask[reg] |= mask;
+	es9038->pending_val[reg] = (es9038->pending_val[reg] & ~mask) | (val & mask);
+	__set_bit(reg, es9038->dirty_regs);
+
+	return 1;
+}
+
+/*
+ * Writes the pending control values. Runs of fully pending registers go out
+ * as one burst. Must be called with the lock held.
+ */
+static int es9038q2m_flush_controls(struct es9038q2m_priv *es9038)
+{
+	u8 vals[ES9038Q2M_NUM_REGISTERS];
+	unsigned int start, end, reg;
+	bool full;
+	int ret;
+
+	for_each_set_bitrange(start, end, es9038->dirty_regs, ES9038Q2M_NUM_REGISTERS) {
+		full = end - start > 1;
+		for (reg = start; reg < end; reg++) {
+			full &= es9038->pending_mask[reg] == 0xFF;
+			vals[reg - start] = es9038->pending_val[reg];
+		}
+
+		if (full) {
+			/* Relies on the regmap not having use_single_write set */
+			ret = regmap_bulk_write(es9038->regmap, start, vals, end - start);
+			if (ret)
+				return ret;
+		} else {
+			for (reg = start; reg < end; reg++) {
+				ret = regmap_update_bits(es9038->regmap, reg,
+							 es9038->pending_mask[reg],
+							 es9038->pending_val[reg]);
+				if (ret)
+					return ret;
+			}
+		}
+
+		for (reg = start; reg < end; reg++) {
+			es9038->pending_mask[reg] = 0;
+			es9038->pending_val[reg] = 0;
+			__clear_bit(reg, es9038->dirty_regs);
+		}
+	}
+
+	es9038->flush_retries = 0;
+
+	return 0;
+}
+
+/*
+ * Gives up on the pending writes. regmap keeps a value in the cache even when
+ * the bus write fails, so those registers are dropped from the cache and the
+ * gets read back what the chip really holds. Must be called with the lock held.
+ */
+static void es9038q2m_drop_pending(struct es9038q2m_priv *es9038)
+{
+	unsigned int start, end;
+
+	for_each_set_bitrange(start, end, es9038->dirty_regs, ES9038Q2M_NUM_REGISTERS)
+		regcache_drop_region(es9038->regmap, start, end - 1);
+
+	bitmap_zero(es9038->dirty_regs, ES9038Q2M_NUM_REGISTERS);
+	memset(es9038->pending_val, 0, sizeof(es9038->pending_val));
+	memset(es9038->pending_mask, 0, sizeof(es9038->pending_mask));
+	es9038->flush_retries = 0;
+}
+
+/* Tells userspace the deferred controls did not end up at the put value */
+static void es9038q2m_notify_controls(struct es9038q2m_priv *es9038)
+{
+	static const char * const names[] = { "DAC Playback Volume", "DAC Filter" };
+	struct snd_soc_component *component = es9038->component;
+	struct snd_kcontrol *kctl;
+	int i;
+
+	if (!component)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		kctl = snd_soc_component_get_kcontrol(component, names[i]);
+		if (kctl)
+			snd_ctl_notify(component->card->snd_card, SNDRV_CTL_EVENT_MASK_VALUE,
+				       &kctl->id);
+	}
+}
+
+static void es9038q2m_flush_work(struct work_struct *work)
+{
+	struct es9038q2m_priv *es9038 = container_of(to_delayed_work(work),
+						     struct es9038q2m_priv, flush_work);
+	struct device *dev = &es9038->i2c->dev;
+	bool dropped = false;
+	int ret;
+
+	mutex_lock(&es9038->lock);
+
+	ret = es9038q2m_flush_controls(es9038);
+	if (ret && ++es9038->flush_retries < ES9038Q2M_FLUSH_MAX_RETRIES) {
+		dev_warn_ratelimited(dev, "Failed to flush control writes, retrying: %d\n", ret);
+		mod_delayed_work(system_wq, &es9038->flush_work,
+				 msecs_to_jiffies(ES9038Q2M_COALESCE_MAX_LATENCY_MS << es9038->flush_retries));
+	} else if (ret) {
+		dev_err(dev, "Dropping control writes after %d failed flushes: %d\n",
+			ES9038Q2M_FLUSH_MAX_RETRIES, ret);
+		es9038q2m_drop_pending(es9038);
+		dropped = true;
+	}
+
+	mutex_unlock(&es9038->lock);
+
+	/*
+	 * Outside the lock, a put holds controls_rwsem before taking it. The
+	 * component stays valid, its remove cancels this work first.
+	 */
+	if (dropped)
+		es9038q2m_notify_controls(es9038);
+}
+
+/* Hands a failed synchronous flush over to the work and its retries */
+static void es9038q2m_retry_flush(struct es9038q2m_priv *es9038)
+{
+	mod_delayed_work(system_wq, &es9038->flush_work,
+			 msecs_to_jiffies(ES9038Q2M_COALESCE_MAX_LATENCY_MS));
+}
+
+/*
+ * Restarts the flush timer on every change so a slider drag is written once
+ * it settles, but never later than ES9038Q2M_COALESCE_MAX_LATENCY_MS after
+ * the first pending change. Must be called with the lock held.
+ */
+static void es9038q2m_schedule_flush(struct es9038q2m_priv *es9038, bool was_idle)
+{
+	unsigned long delay = msecs_to_jiffies(READ_ONCE(coalesce_delay_ms));
+	unsigned long now = jiffies;
+
+	if (was_idle)
+		es9038->flush_deadline = now + msecs_to_jiffies(ES9038Q2M_COALESCE_MAX_LATENCY_MS);
+
+	if (time_after_eq(now, es9038->flush_deadline))
+		delay = 0;
+	else
+		delay = min(delay, es9038->flush_deadline - now);
+
+	mod_delayed_work(system_wq, &es9038->flush_work, delay);
+}
+
+static int es9038q2m_volume_get(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_component *component = snd_kcontrol_chip(kcontrol);
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+	struct soc_mixer_control *mc = (struct soc_mixer_control *)kcontrol->private_value;
+	unsigned int regs[2] = { mc->reg, mc->rreg };
+	unsigned int val;
+	int i;
+
+	if (!es9038->coalesce)
+		return snd_soc_get_volsw(kcontrol, ucontrol);
+
+	mutex_lock(&es9038->lock);
+	for (i = 0; i < 2; i++) {
+		val = (es9038q2m_pending_read(es9038, regs[i]) >> mc->shift) & mc->max;
+		ucontrol->value.integer.value[i] = mc->invert ? mc->max - val : val;
+	}
+	mutex_unlock(&es9038->lock);
+
+	return 0;
+}
+
+/*
+ * In coalescing mode a put only records the new value and returns. The flush
+ * work writes the latest one later, so a burst of volume steps ends up as a
+ * single bus write.
+ */
+static int es9038q2m_volume_put(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_component *component = snd_kcontrol_chip(kcontrol);
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+	struct soc_mixer_control *mc = (struct soc_mixer_control *)kcontrol->private_value;
+	unsigned int regs[2] = { mc->reg, mc->rreg };
+	unsigned int val;
+	bool was_idle;
+	int i, ret = 0;
+
+	if (!es9038->coalesce)
+		return snd_soc_put_volsw(kcontrol, ucontrol);
+
+	for (i = 0; i < 2; i++) {
+		if (ucontrol->value.integer.value[i] < 0 ||
+		    ucontrol->value.integer.value[i] > mc->max)
+			return -EINVAL;
+	}
+
+	mutex_lock(&es9038->lock);
+	was_idle = bitmap_empty(es9038->dirty_regs, ES9038Q2M_NUM_REGISTERS);
+	for (i = 0; i < 2; i++) {
+		val = ucontrol->value.integer.value[i];
+		if (mc->invert)
+			val = mc->max - val;
+		ret |= es9038q2m_pending_update(es9038, regs[i], mc->max << mc->shift,
+						val << mc->shift);
+	}
+	if (ret)
+		es9038q2m_schedule_flush(es9038, was_idle);
+	mutex_unlock(&es9038->lock);
+
+	return ret;
+}
+
+static int es9038q2m_filter_get(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_component *component = snd_kcontrol_chip(kcontrol);
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+	struct soc_enum *e = (struct soc_enum *)kcontrol->private_value;
+	unsigned int val;
+
+	if (!es9038->coalesce)
+		return snd_soc_get_enum_double(kcontrol, ucontrol);
+
+	mutex_lock(&es9038->lock);
+	val = (es9038q2m_pending_read(es9038, e->reg) >> e->shift_l) & e->mask;
+	mutex_unlock(&es9038->lock);
+
+	ucontrol->value.enumerated.item[0] = snd_soc_enum_val_to_item(e, val);
+
+	return 0;
+}
+
+static int es9038q2m_filter_put(struct snd_kcontrol *kcontrol,
+				struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_component *component = snd_kcontrol_chip(kcontrol);
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+	struct soc_enum *e = (struct soc_enum *)kcontrol->private_value;
+	unsigned int item = ucontrol->value.enumerated.item[0];
+	bool was_idle;
+	int ret;
+
+	if (!es9038->coalesce)
+		return snd_soc_put_enum_double(kcontrol, ucontrol);
+
+	if (item >= e->items)
+		return -EINVAL;
+
+	mutex_lock(&es9038->lock);
+	was_idle = bitmap_empty(es9038->dirty_regs, ES9038Q2M_NUM_REGISTERS);
+	ret = es9038q2m_pending_update(es9038, e->reg, e->mask << e->shift_l,
+				       snd_soc_enum_item_to_val(e, item) << e->shift_l);
+	if (ret)
+		es9038q2m_schedule_flush(es9038, was_idle);
+	mutex_unlock(&es9038->lock);
+
+	return ret;
+}
+
+/* Mute is never deferred, pending writes go out first to keep the order */
+static int es9038q2m_mute_put(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_component *component = snd_kcontrol_chip(kcontrol);
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+	int ret;
+
+	if (!es9038->coalesce)
+		return snd_soc_put_volsw(kcontrol, ucontrol);
+
+	mutex_lock(&es9038->lock);
+	ret = es9038q2m_flush_controls(es9038);
+	if (ret == 0)
+		ret = snd_soc_put_volsw(kcontrol, ucontrol);
+	else
+		es9038q2m_retry_flush(es9038);
+	mutex_unlock(&es9038->lock);
+
+	return ret;
+}
+
 static const struct snd_kcontrol_new es9038q2m_snd_controls[] = {
-	SOC_DOUBLE_R_TLV("DAC Playback Volume", ES9038Q2M_REG_VOL_CH1, ES9038Q2M_REG_VOL_CH2, 0, 255, 1, dac_tlv),
-	SOC_SINGLE("DAC Mute", ES9038Q2M_REG_FILTER_SHAPE, 0, 1, 0),
-	SOC_ENUM("DAC Filter", es9038q2m_filter_enum),
+	SOC_DOUBLE_R_EXT_TLV("DAC Playback Volume", ES9038Q2M_REG_VOL_CH1, ES9038Q2M_REG_VOL_CH2, 0, 255, 1,
+			     es9038q2m_volume_get, es9038q2m_volume_put, dac_tlv),
+	SOC_SINGLE_EXT("DAC Mute", ES9038Q2M_REG_FILTER_SHAPE, 0, 1, 0,
+		       snd_soc_get_volsw, es9038q2m_mute_put),
+	SOC_ENUM_EXT("DAC Filter", es9038q2m_filter_enum,
+		     es9038q2m_filter_get, es9038q2m_filter_put),
 };
 
+static int es9038q2m_component_probe(struct snd_soc_component *component)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+
+	mutex_lock(&es9038->lock);
+	es9038->component = component;
+	mutex_unlock(&es9038->lock);
+
+	return 0;
+}
+
+/* Pending values reach the chip before the controls go away */
+static void es9038q2m_component_remove(struct snd_soc_component *component)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
+
+	cancel_delayed_work_sync(&es9038->flush_work);
+
+	mutex_lock(&es9038->lock);
+	es9038q2m_flush_controls(es9038);
+	es9038->component = NULL;
+	mutex_unlock(&es9038->lock);
+}
+
 static const struct snd_soc_component_driver es9038q2m_codec_driver = {
+	.probe              = es9038q2m_component_probe,
+	.remove             = es9038q2m_component_remove,
 	.controls           = es9038q2m_snd_controls,
 	.num_controls       = ARRAY_SIZE(es9038q2m_snd_controls),
 };
@@ -164,17 +578,223 @@ static const struct regmap_config es9038q2m_regmap_config = {
 	.max_register     = ES9038Q2M_NUM_REGISTERS - 1,
 	.reg_defaults     = es9038q2m_reg_defaults,
 	.num_reg_defaults = ARRAY_SIZE(es9038q2m_reg_defaults),
-    .use_single_read  = true,
-	.use_single_write = true,
 	.writeable_reg    = es9038q2m_writable_reg,
 	.readable_reg     = es9038q2m_readable_reg,
 	.volatile_reg     = es9038q2m_volatile_reg,
 	.cache_type       = REGCACHE_RBTREE,
 };
 
-static int es9038q2m_hw_params(struct snd_pcm_substream *substream,
-				struct snd_pcm_hw_params *params,
-				struct snd_soc_dai *dai)
+/*
+ * A supply glitch resets the chip to its defaults. Holds register writes in
+ * the cache until the supplies are back, then rewrites what differs from the
+ * defaults. The card is left registered so userspace never notices.
+ */
+static void es9038q2m_supply_lost(struct es9038q2m_priv *es9038)
+{
+	mutex_lock(&es9038->lock);
+	es9038->supply_lost = true;
+	es9038->resync_retries = 0;
+	regcache_cache_only(es9038->regmap, true);
+	regcache_mark_dirty(es9038->regmap);
+	mutex_unlock(&es9038->lock);
+}
+
+/* Every supply event starts a fresh round of resync attempts */
+static void es9038q2m_schedule_resync(struct es9038q2m_priv *es9038)
+{
+	mutex_lock(&es9038->lock);
+	es9038->resync_retries = 0;
+	mutex_unlock(&es9038->lock);
+
+	mod_delayed_work(system_wq, &es9038->resync_work,
+			 msecs_to_jiffies(ES9038Q2M_RESYNC_DELAY_MS));
+}
+
+#define ES9038Q2M_SUPPLY_EVENT(n) \
+static int es9038q2m_supply_event_##n(struct notifier_block *nb, \
+				      unsigned long event, void *data) \
+{ \
+	struct es9038q2m_priv *es9038 = container_of(nb, struct es9038q2m_priv, \
+						     supply_nb[n]); \
+	if (event & (REGULATOR_EVENT_DISABLE | REGULATOR_EVENT_FORCE_DISABLE | \
+		     REGULATOR_EVENT_UNDER_VOLTAGE | REGULATOR_EVENT_FAIL)) { \
+		es9038q2m_supply_lost(es9038); \
+		es9038q2m_schedule_resync(es9038); \
+	} else if (event & REGULATOR_EVENT_ENABLE) { \
+		es9038q2m_schedule_resync(es9038); \
+	} \
+	return NOTIFY_OK; \
+}
+
+ES9038Q2M_SUPPLY_EVENT(0)
+ES9038Q2M_SUPPLY_EVENT(1)
+ES9038Q2M_SUPPLY_EVENT(2)
+
+static void es9038q2m_resync_work(struct work_struct *work)
+{
+	struct es9038q2m_priv *es9038 = container_of(to_delayed_work(work),
+						     struct es9038q2m_priv, resync_work);
+	struct device *dev = &es9038->i2c->dev;
+	unsigned int regval;
+	int i, ret;
+
+	/* Waits for the ENABLE event if any supply is still down */
+	for (i = 0; i < ES9038Q2M_NUM_SUPPLIES; i++) {
+		if (regulator_is_enabled(es9038->supplies[i].consumer) <= 0)
+			return;
+	}
+
+	mutex_lock(&es9038->lock);
+
+	if (!es9038->supply_lost)
+		goto out;
+
+	regcache_cache_only(es9038->regmap, false);
+
+	/* Makes sure the chip answers again before restoring it */
+	ret = regmap_read(es9038->regmap, ES9038Q2M_REG_CHIP_ID, &regval);
+	if (ret == 0 && (regval & ES9038Q2M_CHIP_ID) != ES9038Q2M_CHIP_ID_NBR)
+		ret = -ENODEV;
+	if (ret == 0)
+		ret = regcache_sync(es9038->regmap);
+
+	if (ret) {
+		regcache_cache_only(es9038->regmap, true);
+		regcache_mark_dirty(es9038->regmap);
+
+		/* Gives up until the next supply event if the chip stays silent */
+		if (++es9038->resync_retries >= ES9038Q2M_RESYNC_MAX_RETRIES) {
+			dev_err(dev, "Chip not answering after supply loss, giving up: %d\n", ret);
+			goto out;
+		}
+
+		dev_warn_ratelimited(dev, "Failed to resync registers after supply loss: %d\n", ret);
+		mod_delayed_work(system_wq, &es9038->resync_work,
+				 msecs_to_jiffies(min(ES9038Q2M_RESYNC_DELAY_MS << es9038->resync_retries,
+						      ES9038Q2M_RESYNC_MAX_DELAY_MS)));
+		goto out;
+	}
+
+	es9038->supply_lost = false;
+	es9038->resync_retries = 0;
+	dev_info(dev, "Registers restored after supply loss\n");
+
+out:
+	mutex_unlock(&es9038->lock);
+}
+
+static void es9038q2m_disable_supplies(void *data)
+{
+	struct es9038q2m_priv *es9038 = data;
+
+	regulator_bulk_disable(ES9038Q2M_NUM_SUPPLIES, es9038->supplies);
+}
+
+/*
+ * Reads the whole read-only block in one burst, unless the last snapshot is
+ * still within the freshness window. Must be called with status_lock held.
+ */
+static int es9038q2m_status_refresh(struct es9038q2m_priv *es9038)
+{
+	u64 now = ktime_get_ns();
+	int ret;
+
+	if (es9038->status_valid &&
+	    now - es9038->status_time_ns < (u64)es9038->status_max_age_ms * NSEC_PER_MSEC)
+		return 0;
+
+	ret = regmap_bulk_read(es9038->regmap, ES9038Q2M_REG_CHIP_ID,
+			       es9038->status.regs, ES9038Q2M_STATUS_COUNT);
+	if (ret)
+		return ret;
+
+	es9038->status.timestamp_ns = cpu_to_le64(now);
+	es9038->status_time_ns = now;
+	es9038->status_valid = true;
+
+	return 0;
+}
+
+static ssize_t status_snapshot_read(struct file *filp, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct es9038q2m_priv *es9038 = dev_get_drvdata(kobj_to_dev(kobj));
+	ssize_t ret = 0;
+
+	mutex_lock(&es9038->status_lock);
+
+	/* Only a read from the start takes a new snapshot */
+	if (off == 0)
+		ret = es9038q2m_status_refresh(es9038);
+
+	if (ret == 0)
+		ret = memory_read_from_buffer(buf, count, &off, &es9038->status,
+					      sizeof(es9038->status));
+
+	mutex_unlock(&es9038->status_lock);
+
+	return ret;
+}
+static BIN_ATTR_RO(status_snapshot, sizeof(struct es9038q2m_status));
+
+static ssize_t status_max_age_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct es9038q2m_priv *es9038 = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(es9038->status_max_age_ms));
+}
+
+static ssize_t status_max_age_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct es9038q2m_priv *es9038 = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&es9038->status_lock);
+	es9038->status_max_age_ms = val;
+	mutex_unlock(&es9038->status_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(status_max_age_ms);
+
+static ssize_t dpll_lock_time_us_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct es9038q2m_priv *es9038 = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(es9038->dpll_lock_time_us));
+}
+static DEVICE_ATTR_RO(dpll_lock_time_us);
+
+static struct attribute *es9038q2m_attrs[] = {
+	&dev_attr_status_max_age_ms.attr,
+	&dev_attr_dpll_lock_time_us.attr,
+	NULL
+};
+
+static struct bin_attribute *es9038q2m_bin_attrs[] = {
+	&bin_attr_status_snapshot,
+	NULL
+};
+
+static const struct attribute_group es9038q2m_group = {
+	.attrs     = es9038q2m_attrs,
+	.bin_attrs = es9038q2m_bin_attrs,
+};
+__ATTRIBUTE_GROUPS(es9038q2m);
+
+static int es9038q2m_set_hw_params(struct snd_pcm_substream *substream,
+				    struct snd_pcm_hw_params *params,
+				    struct snd_soc_dai *dai)
 {
 	struct snd_soc_component *component = dai->component;
 	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
@@ -253,12 +873,43 @@ static int es9038q2m_hw_params(struct snd_pcm_substream *substream,
 	es9038->rate = rate;	
 	es9038->width = width;
 
+	/* The DPLL relocks from here, a new lock time is measured */
+	cancel_delayed_work_sync(&es9038->dpll_work);
+	WRITE_ONCE(es9038->dpll_unlocked_ts, 0);
+	WRITE_ONCE(es9038->dpll_irq_ts, 0);
+	es9038->dpll_ref_ts = ktime_get();
+	es9038->dpll_lock_measured = false;
+	WRITE_ONCE(es9038->dpll_lock_time_us, 0);
+
 	dev_info(component->dev, "HW Params set to: %dHz, %d bits. DSD = %d\n", rate, width, is_dsd);
 	
 	return 0; 
 }
 
-static int es9038q2m_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
+/* Runs with the lock held so deferred control puts cannot interleave */
+static int es9038q2m_hw_params(struct snd_pcm_substream *substream,
+				struct snd_pcm_hw_params *params,
+				struct snd_soc_dai *dai)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(dai->component);
+	int ret;
+
+	mutex_lock(&es9038->lock);
+
+	/* Pending control writes go out before the stream is reconfigured */
+	ret = es9038q2m_flush_controls(es9038);
+	if (ret) {
+		dev_err(dai->dev, "Failed to flush control writes: %d\n", ret);
+		es9038q2m_retry_flush(es9038);
+	} else
+		ret = es9038q2m_set_hw_params(substream, params, dai);
+
+	mutex_unlock(&es9038->lock);
+
+	return ret;
+}
+
+static int es9038q2m_set_dai_fmt_locked(struct snd_soc_dai *dai, unsigned int fmt)
 {
 	struct snd_soc_component *component = dai->component;
 	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(component);
@@ -328,9 +979,228 @@ static int es9038q2m_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 	return 0; 
 }
 
+static int es9038q2m_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(dai->component);
+	int ret;
+
+	mutex_lock(&es9038->lock);
+	ret = es9038q2m_set_dai_fmt_locked(dai, fmt);
+	mutex_unlock(&es9038->lock);
+
+	return ret;
+}
+
+static irqreturn_t es9038q2m_irq(int irq, void *data)
+{
+	struct es9038q2m_priv *es9038 = data;
+
+	/* Timestamp of the lock edge, exact unlike the status polls */
+	WRITE_ONCE(es9038->dpll_irq_ts, ktime_get());
+	complete(&es9038->dpll_lock);
+
+	return IRQ_HANDLED;
+}
+
+static int es9038q2m_dpll_locked(struct es9038q2m_priv *es9038)
+{
+	unsigned int regval;
+	int ret;
+
+	ret = regmap_read(es9038->regmap, ES9038Q2M_REG_CHIP_ID, &regval);
+	if (ret)
+		return ret;
+
+	return !!(regval & ES9038Q2M_DPLL_LOCK_STATUS);
+}
+
+/*
+ * Records the lock time of the current hw_params setup. The IRQ edge is
+ * measured from the point the DPLL started relocking, a poll from when
+ * polling started, seen is when the poll found the lock.
+ */
+static void es9038q2m_record_lock(struct es9038q2m_priv *es9038, ktime_t seen)
+{
+	ktime_t edge = READ_ONCE(es9038->dpll_irq_ts);
+	s64 us;
+
+	if (es9038->dpll_lock_measured)
+		return;
+
+	if (edge && ktime_after(edge, es9038->dpll_ref_ts))
+		us = ktime_us_delta(edge, es9038->dpll_ref_ts);
+	else
+		us = ktime_us_delta(seen, es9038->dpll_poll_ts);
+
+	WRITE_ONCE(es9038->dpll_lock_time_us, max_t(s64, us, 0));
+	es9038->dpll_lock_measured = true;
+}
+
+/*
+ * Waits for the lock flag with an exponential backoff between status reads.
+ * When the board wires the interrupt it cuts each wait short. Returns 1 if
+ * the first read already showed lock, 0 if it locked while waiting.
+ */
+static int es9038q2m_wait_dpll_lock(struct es9038q2m_priv *es9038, unsigned int timeout_ms)
+{
+	ktime_t deadline = ktime_add_ms(ktime_get(), timeout_ms);
+	unsigned int delay_us = ES9038Q2M_LOCK_POLL_MIN_US;
+	s64 remaining_us;
+	bool first = true;
+	int ret;
+
+	for (;;) {
+		reinit_completion(&es9038->dpll_lock);
+
+		ret = es9038q2m_dpll_locked(es9038);
+		if (ret)
+			return ret < 0 ? ret : first;
+		first = false;
+
+		remaining_us = ktime_us_delta(deadline, ktime_get());
+		if (remaining_us <= 0)
+			return -ETIMEDOUT;
+
+		delay_us = min_t(s64, delay_us, remaining_us);
+		if (es9038->lock_irq)
+			wait_for_completion_timeout(&es9038->dpll_lock,
+						    usecs_to_jiffies(delay_us));
+		else
+			usleep_range(delay_us, delay_us + delay_us / 4);
+
+		delay_us = min_t(unsigned int, delay_us * 2, ES9038Q2M_LOCK_POLL_MAX_US);
+	}
+}
+
+/* Keeps timing a stream that was started before the DPLL locked */
+static void es9038q2m_dpll_work(struct work_struct *work)
+{
+	struct es9038q2m_priv *es9038 = container_of(to_delayed_work(work),
+						     struct es9038q2m_priv, dpll_work);
+	ktime_t unlocked = READ_ONCE(es9038->dpll_unlocked_ts);
+	ktime_t now = ktime_get();
+	ktime_t edge;
+
+	if (es9038q2m_dpll_locked(es9038) > 0) {
+		es9038q2m_record_lock(es9038, now);
+
+		/* An edge before the stream started means nothing was lost */
+		edge = READ_ONCE(es9038->dpll_irq_ts);
+		if (!edge)
+			edge = now;
+		else if (!ktime_after(edge, unlocked))
+			edge = unlocked;
+		WRITE_ONCE(es9038->dpll_late_lock_ts, edge);
+		return;
+	}
+
+	if (ktime_ms_delta(now, unlocked) < ES9038Q2M_LOCK_LATE_MAX_MS)
+		queue_delayed_work(system_wq, &es9038->dpll_work,
+				   usecs_to_jiffies(ES9038Q2M_LOCK_POLL_MAX_US));
+}
+
+/*
+ * From here on the stream plays while the DPLL may still be unlocked. The
+ * caller has set dpll_poll_ts to when lock polling started.
+ */
+static void es9038q2m_start_unlocked(struct es9038q2m_priv *es9038)
+{
+	/* Older edges belong to a lock that did not hold */
+	WRITE_ONCE(es9038->dpll_irq_ts, 0);
+	WRITE_ONCE(es9038->dpll_late_lock_ts, 0);
+	WRITE_ONCE(es9038->dpll_unlocked_ts, ktime_get());
+	mod_delayed_work(system_wq, &es9038->dpll_work, 0);
+}
+
+static int es9038q2m_prepare(struct snd_pcm_substream *substream,
+			     struct snd_soc_dai *dai)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(dai->component);
+	unsigned int timeout_ms = READ_ONCE(dpll_lock_timeout_ms);
+	int ret;
+
+	cancel_delayed_work_sync(&es9038->dpll_work);
+	WRITE_ONCE(es9038->dpll_unlocked_ts, 0);
+
+	/* As slave the DPLL has no clocks to lock to, trigger starts the timing */
+	if (!es9038->is_master)
+		return 0;
+
+	es9038->dpll_poll_ts = ktime_get();
+	if (!timeout_ms) {
+		es9038q2m_start_unlocked(es9038);
+		return 0;
+	}
+
+	ret = es9038q2m_wait_dpll_lock(es9038, timeout_ms);
+	if (ret < 0) {
+		dev_warn(dai->dev, "DPLL not locked before stream start: %d\n", ret);
+		es9038q2m_start_unlocked(es9038);
+		return 0;
+	}
+
+	/* A re-prepare without hw_params keeps the lock time of that setup */
+	es9038q2m_record_lock(es9038, ret ? es9038->dpll_poll_ts : ktime_get());
+	dev_dbg(dai->dev, "DPLL locked in %u us\n", es9038->dpll_lock_time_us);
+
+	return 0;
+}
+
+static int es9038q2m_trigger(struct snd_pcm_substream *substream, int cmd,
+			     struct snd_soc_dai *dai)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(dai->component);
+
+	if (es9038->is_master)
+		return 0;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		/* Clocks start now, so does the relock */
+		es9038->dpll_ref_ts = ktime_get();
+		es9038->dpll_poll_ts = es9038->dpll_ref_ts;
+		es9038q2m_start_unlocked(es9038);
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		cancel_delayed_work(&es9038->dpll_work);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Reports the part of the lock time the stream was not held back for: from
+ * the moment it started unlocked until the lock, or until now while still
+ * unlocked. Streams that prepare saw locked report 0. Only the first period
+ * carries it, it is a startup offset rather than pipeline latency.
+ */
+static snd_pcm_sframes_t es9038q2m_delay(struct snd_pcm_substream *substream,
+					 struct snd_soc_dai *dai)
+{
+	struct es9038q2m_priv *es9038 = snd_soc_component_get_drvdata(dai->component);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	ktime_t unlocked = READ_ONCE(es9038->dpll_unlocked_ts);
+	ktime_t locked = READ_ONCE(es9038->dpll_late_lock_ts);
+	s64 us;
+
+	if (!READ_ONCE(dpll_lock_delay) || !unlocked ||
+	    runtime->status->hw_ptr >= runtime->period_size)
+		return 0;
+
+	us = ktime_us_delta(locked ? locked : ktime_get(), unlocked);
+	if (us <= 0)
+		return 0;
+
+	return div_u64((u64)us * es9038->rate, USEC_PER_SEC);
+}
+
 static const struct snd_soc_dai_ops es9038q2m_dai_ops = {
 	.hw_params = es9038q2m_hw_params,
 	.set_fmt   = es9038q2m_set_dai_fmt,
+	.prepare   = es9038q2m_prepare,
+	.trigger   = es9038q2m_trigger,
+	.delay     = es9038q2m_delay,
 };
 
 
@@ -352,7 +1222,7 @@ static struct snd_soc_dai_driver es9038q2m_dai = {
 static int es9038q2m_i2c_probe(struct i2c_client *i2c)
 {
     struct es9038q2m_priv *es9038q2m;
-	int ret, chip_id;
+	int i, ret, chip_id;
 	unsigned int regval;
     struct device *dev = &i2c->dev;
 	struct device_node *np = dev->of_node;
@@ -365,6 +1235,9 @@ static int es9038q2m_i2c_probe(struct i2c_client *i2c)
 	
     es9038q2m->i2c = i2c;
 	mutex_init(&es9038q2m->lock);
+	mutex_init(&es9038q2m->status_lock);
+	init_completion(&es9038q2m->dpll_lock);
+	es9038q2m->status_max_age_ms = ES9038Q2M_STATUS_MAX_AGE_MS;
 	es9038q2m->regmap = devm_regmap_init_i2c(i2c, &es9038q2m_regmap_config);
 	if (IS_ERR(es9038q2m->regmap)) {
 		ret = PTR_ERR(es9038q2m->regmap);
@@ -372,6 +1245,54 @@ static int es9038q2m_i2c_probe(struct i2c_client *i2c)
 		return ret;
 	}
 
+	/* Gets and powers up DVCC, VCCA and AVCC */
+	for (i = 0; i < ES9038Q2M_NUM_SUPPLIES; i++)
+		es9038q2m->supplies[i].supply = es9038q2m_supply_names[i];
+
+	ret = devm_regulator_bulk_get(dev, ES9038Q2M_NUM_SUPPLIES, es9038q2m->supplies);
+	if (ret) {
+		dev_err(dev, "Failed to request supplies: %d\n", ret);
+		return ret;
+	}
+
+	ret = regulator_bulk_enable(ES9038Q2M_NUM_SUPPLIES, es9038q2m->supplies);
+	if (ret) {
+		dev_err(dev, "Failed to enable supplies: %d\n", ret);
+		return ret;
+	}
+
+	ret = devm_add_action_or_reset(dev, es9038q2m_disable_supplies, es9038q2m);
+	if (ret)
+		return ret;
+
+	/* Lets the rails settle before the first bus access */
+	msleep(ES9038Q2M_RESYNC_DELAY_MS);
+
+	ret = devm_delayed_work_autocancel(dev, &es9038q2m->resync_work, es9038q2m_resync_work);
+	if (ret)
+		return ret;
+
+	/* Opt-in deferral of mixer control writes */
+	es9038q2m->coalesce = coalesce_controls;
+	ret = devm_delayed_work_autocancel(dev, &es9038q2m->flush_work, es9038q2m_flush_work);
+	if (ret)
+		return ret;
+
+	/* Watches the supplies so a brownout does not leave the DAC at its defaults */
+	es9038q2m->supply_nb[0].notifier_call = es9038q2m_supply_event_0;
+	es9038q2m->supply_nb[1].notifier_call = es9038q2m_supply_event_1;
+	es9038q2m->supply_nb[2].notifier_call = es9038q2m_supply_event_2;
+
+	for (i = 0; i < ES9038Q2M_NUM_SUPPLIES; i++) {
+		ret = devm_regulator_register_notifier(es9038q2m->supplies[i].consumer,
+						       &es9038q2m->supply_nb[i]);
+		if (ret) {
+			dev_err(dev, "Failed to register %s notifier: %d\n",
+				es9038q2m_supply_names[i], ret);
+			return ret;
+		}
+	}
+
 	/* Gets MCLK info from Device Tree */
 	ret = of_property_read_u32(np, "clock-frequency", &es9038q2m->mclk);
     if (ret) {
@@ -399,6 +1320,42 @@ static int es9038q2m_i2c_probe(struct i2c_client *i2c)
 	/* Print the detected chip ID */
 	dev_info(dev, "ES9038Q2M detected, CHIP_ID = 0x%02X \n", chip_id);
 
+	ret = devm_delayed_work_autocancel(dev, &es9038q2m->dpll_work, es9038q2m_dpll_work);
+	if (ret)
+		return ret;
+
+	/*
+	 * Optional interrupt, GPIO1 is wired to it and follows the lock flag.
+	 * The level stays asserted while locked and the handler cannot clear
+	 * it, so only edge triggers are usable.
+	 */
+	if (i2c->irq > 0) {
+		unsigned int irq_type = irq_get_trigger_type(i2c->irq);
+
+		if (irq_type & IRQ_TYPE_LEVEL_MASK) {
+			dev_warn(dev, "Level triggered IRQ %d not supported, polling DPLL lock\n",
+				 i2c->irq);
+		} else {
+			ret = regmap_update_bits(es9038q2m->regmap, ES9038Q2M_REG_GPIO_CFG,
+						 ES9038Q2M_GPIO1_CFG_MASK,
+						 ES9038Q2M_GPIO_CFG_LOCK_STATUS);
+			if (ret) {
+				dev_err(dev, "Failed to route DPLL lock to GPIO1: %d\n", ret);
+				return ret;
+			}
+
+			/* Rising edge unless DT already gave an edge type */
+			ret = devm_request_irq(dev, i2c->irq, es9038q2m_irq,
+					       irq_type ? 0 : IRQF_TRIGGER_RISING,
+					       dev_name(dev), es9038q2m);
+			if (ret) {
+				dev_err(dev, "Failed to request IRQ %d: %d\n", i2c->irq, ret);
+				return ret;
+			}
+			es9038q2m->lock_irq = true;
+		}
+	}
+
 	/* Register with ASoC */
 	ret = devm_snd_soc_register_component(dev, &es9038q2m_codec_driver,
 					      &es9038q2m_dai, 1);
@@ -429,6 +1386,7 @@ static struct i2c_driver es9038q2m_i2c_driver = {
 	.driver = {
 		.name = "es9038q2m",
 		.of_match_table = of_match_ptr(es9038q2m_of_match),
+		.dev_groups = es9038q2m_groups,
 	},
 	.probe = es9038q2m_i2c_probe,  // ✅ Essencial
 	.id_table = es9038q2m_i2c_id,
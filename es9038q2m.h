@@ -205,6 +205,9 @@
  * ========================= */
 // gpio1_cfg = bits [3:0], gpio2_cfg = bits [7:4]
 // Use values 0–15 for function, per datasheet table
+#define ES9038Q2M_GPIO1_CFG_MASK         0x0F
+#define ES9038Q2M_GPIO2_CFG_MASK         0xF0
+#define ES9038Q2M_GPIO_CFG_LOCK_STATUS   0x01  /* Pin follows DPLL lock */
 
 /* =========================
  * REG_MASTER_MODE (0x0A)